@@ -4,18 +4,31 @@
 #include "v8.h"
 #include "v8-profiler.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <condition_variable>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <vector>
 #include <sstream>
 #include <stdio.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <iostream>
 
 #define ISOLATE_SCOPE(iso) \
   v8::Isolate* isolate = (iso);                                                               \
   v8::Locker locker(isolate);                            /* Lock to current thread.        */ \
   v8::Isolate::Scope isolate_scope(isolate);             /* Assign isolate to this thread. */ \
-  isolate->SetStackLimit(reinterpret_cast<uintptr_t>(static_cast<char*>(__crystal_current_fiber_stack()) + 4 * 1024));
+  StackLimitScope stack_limit_scope(isolate);            /* Follow the current fiber.      */
 
 #define VALUE_SCOPE(ctxptr) \
   ISOLATE_SCOPE(static_cast<Context*>(ctxptr)->isolate)                                       \
@@ -23,7 +36,7 @@
   v8::Local<v8::Context> ctx(static_cast<Context*>(ctxptr)->ptr.Get(isolate));                \
   v8::Context::Scope context_scope(ctx);                 /* Scope to this context.         */
 
-extern "C" void* __crystal_current_fiber_stack();
+extern "C" void __crystal_current_fiber_stack(void** low, void** high);
 // extern "C" ValueErrorPair go_callback_handler(
 //     String id, CallerInfo info, int argc, ValueKindsPair* argv);
 
@@ -43,12 +56,295 @@ void ArrayBufferAllocator::Free(void* data, size_t) { free(data); }
 // We only need one, it's stateless.
 ArrayBufferAllocator allocator;
 
+v8::Platform* platform = nullptr;
+
+// Memory behind SharedArrayBuffers that may live in several isolates at once.
+// The Crystal owner and every SharedArrayBuffer over it hold a reference.
+class SharedBacking {
+ public:
+  explicit SharedBacking(size_t len) : data(calloc(len, 1)), len(len), refs_(1) {}
+
+  void Retain() { refs_++; }
+  void Release() {
+    if (--refs_ == 0) {
+      free(data);
+      delete this;
+    }
+  }
+
+  int32_t* Int32At(size_t index) { return static_cast<int32_t*>(data) + index; }
+
+  void* data;
+  size_t len;
+
+ private:
+  std::atomic<int> refs_;
+};
+
+// Drops a SharedArrayBuffer's reference on its backing once it is collected.
+struct SharedBufferRef {
+  v8::Global<v8::SharedArrayBuffer> handle;
+  SharedBacking* backing;
+};
+
+// Ties a Crystal holder given to v8_ObjectTemplate_NewInstance to the
+// lifetime of the object made with it.
+struct HolderRef {
+  v8::Global<v8::Object> handle;
+  void* holder;
+};
+
+// Source of a streamed script. Chunks are pushed from Crystal and pulled by
+// V8's parser on a background thread, which blocks until more data arrives.
+class ChunkedSourceStream : public v8::ScriptCompiler::ExternalSourceStream {
+ public:
+  ChunkedSourceStream() : done_(false) {}
+
+  virtual size_t GetMoreData(const uint8_t** src) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    cond_.wait(lock, [this] { return !chunks_.empty() || done_; });
+    if (chunks_.empty()) {
+      *src = nullptr;
+      return 0;
+    }
+    Chunk chunk = chunks_.front();
+    chunks_.pop_front();
+    *src = chunk.first;  // V8 takes ownership.
+    return chunk.second;
+  }
+
+  void Push(const char* data, size_t len) {
+    uint8_t* chunk = new uint8_t[len];
+    memcpy(chunk, data, len);
+    std::lock_guard<std::mutex> lock(mutex_);
+    chunks_.push_back(Chunk(chunk, len));
+    cond_.notify_one();
+  }
+
+  void Finish() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    done_ = true;
+    cond_.notify_one();
+  }
+
+ private:
+  typedef std::pair<uint8_t*, size_t> Chunk;
+
+  std::mutex mutex_;
+  std::condition_variable cond_;
+  std::deque<Chunk> chunks_;
+  bool done_;
+};
+
+class ScriptStream {
+ public:
+  ScriptStream()
+    : stream(new ChunkedSourceStream),
+      source(stream, v8::ScriptCompiler::StreamedSource::UTF8) {
+    if (pipe(compiled_fds) != 0) {
+      compiled_fds[0] = compiled_fds[1] = -1;
+      return;
+    }
+    fcntl(compiled_fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(compiled_fds[1], F_SETFD, FD_CLOEXEC);
+  }
+  ~ScriptStream() {
+    if (compiled_fds[1] >= 0) {
+      close(compiled_fds[1]);
+    }
+  }
+
+  ChunkedSourceStream* stream;  // Owned by source.
+  v8::ScriptCompiler::StreamedSource source;
+  std::string code;  // V8 needs the full source again to finalize.
+  // A byte is written to the second fd once the background compile is done.
+  // The first is handed to Crystal, which waits on it and closes it.
+  int compiled_fds[2];
+};
+
+// Runs V8's streaming task on a platform worker thread.
+class StreamingTask : public v8::Task {
+ public:
+  StreamingTask(v8::ScriptCompiler::ScriptStreamingTask* task, ScriptStream* stream)
+    : task_(task), stream_(stream) {}
+  virtual ~StreamingTask() { delete task_; }
+
+  virtual void Run() {
+    task_->Run();
+    char done = 1;
+    while (write(stream_->compiled_fds[1], &done, 1) < 0 && errno == EINTR) {
+    }
+  }
+
+ private:
+  v8::ScriptCompiler::ScriptStreamingTask* task_;
+  ScriptStream* stream_;
+};
+
+static const int kMaxStackArgs = 8;
+
+// Argument vector for calls into JS; small arities stay on the stack.
+class Argv {
+ public:
+  explicit Argv(int argc) : ptr_(argc > kMaxStackArgs ? new v8::Local<v8::Value>[argc] : stack_) {}
+  ~Argv() { if (ptr_ != stack_) delete[] ptr_; }
+  v8::Local<v8::Value>& operator[](int i) { return ptr_[i]; }
+  v8::Local<v8::Value>* get() { return ptr_; }
+
+ private:
+  Argv(const Argv&);
+  void operator=(const Argv&);
+
+  v8::Local<v8::Value> stack_[kMaxStackArgs];
+  v8::Local<v8::Value>* ptr_;
+};
+
+// A Crystal function bound with a fixed signature: one type code per
+// argument ('d' Float64, 'i' Int32, 'u' Uint32, 'b' Bool) and a result code
+// (the same, or 'v' for none).
+typedef struct {
+  std::string args;
+  char result;
+  void* data;  // Boxed Crystal trampoline.
+} TypedCallback;
+
+static const int kMaxTypedArgs = 16;
+
+// A module compiled in a context, with the source it was compiled from so a
+// different source under the same specifier is recompiled.
+struct CompiledModule {
+  v8::Global<v8::Module> module;
+  std::string source;
+};
+
 typedef struct {
   v8::Persistent<v8::Context> ptr;
   v8::Isolate* isolate;
+  std::string id;           // Crystal-side id, passed back to callbacks.
+  std::map<std::string, CompiledModule> modules;
+  std::vector<std::unique_ptr<TypedCallback>> typed_callbacks;
+  // Weak handles to contexts replaced by v8_Context_Reset, whose embedder
+  // data still points here.
+  std::vector<v8::Global<v8::Context>> detached;
 } Context;
 
-typedef v8::Persistent<v8::Value> Value;
+// Per-isolate state, stored in isolate data slot 0.
+typedef struct {
+  // Global template every context of the isolate is created from, so host
+  // bindings registered on it are set up once instead of per context.
+  v8::Persistent<v8::ObjectTemplate> globals;
+  // Low end of the fiber stack the stack limit was last computed for, and
+  // that limit.
+  void* stack = nullptr;
+  uintptr_t stack_limit = 0;
+  // How many StackLimitScopes are open.
+  int depth = 0;
+  // Weak callbacks don't run when the isolate is disposed, so refs still
+  // alive then are released by v8_Isolate_Release.
+  std::set<HolderRef*> holders;
+  std::set<SharedBufferRef*> shared_buffers;
+  // Points into the Crystal-owned blob the isolate was created from.
+  std::unique_ptr<v8::StartupData> snapshot;
+} IsolateData;
+
+void release_shared_buffer(SharedBufferRef* ref) {
+  ref->handle.Reset();
+  ref->backing->Release();
+  delete ref;
+}
+
+void shared_buffer_collected(const v8::WeakCallbackInfo<SharedBufferRef>& info) {
+  SharedBufferRef* ref = info.GetParameter();
+  static_cast<IsolateData*>(info.GetIsolate()->GetData(0))->shared_buffers.erase(ref);
+  release_shared_buffer(ref);
+}
+
+extern "C" void __crystal_v8_holder_collected(void* holder);
+
+void release_holder(HolderRef* ref) {
+  ref->handle.Reset();
+  __crystal_v8_holder_collected(ref->holder);
+  delete ref;
+}
+
+void holder_collected(const v8::WeakCallbackInfo<HolderRef>& info) {
+  HolderRef* ref = info.GetParameter();
+  static_cast<IsolateData*>(info.GetIsolate()->GetData(0))->holders.erase(ref);
+  release_holder(ref);
+}
+
+// Room left below V8's stack limit for the native frames of the bridge and
+// of Crystal callbacks, capped at a quarter of small stacks.
+static const size_t kStackReserve = 64 * 1024;
+
+// Points V8's stack limit at the current fiber's stack. Crystal fibers each
+// have their own stack, so this is redone whenever the isolate is entered
+// from a different one, but only then. A scope nested in another one, such
+// as a callback entering the isolate from another fiber, puts the outer
+// limit back on exit so the code it returns to keeps its own.
+class StackLimitScope {
+ public:
+  explicit StackLimitScope(v8::Isolate* isolate)
+      : isolate_(isolate), data_(static_cast<IsolateData*>(isolate->GetData(0))), restore_(false) {
+    if (data_ == nullptr) {
+      return;
+    }
+    void *low = nullptr, *high = nullptr;
+    __crystal_current_fiber_stack(&low, &high);
+    if (low != nullptr && low != data_->stack) {
+      restore_ = data_->depth > 0 && data_->stack_limit != 0;
+      saved_stack_ = data_->stack;
+      saved_limit_ = data_->stack_limit;
+
+      size_t reserve = kStackReserve;
+      if (high > low) {
+        size_t size = static_cast<char*>(high) - static_cast<char*>(low);
+        reserve = size / 4 < reserve ? size / 4 : reserve;
+      }
+      data_->stack = low;
+      data_->stack_limit = reinterpret_cast<uintptr_t>(static_cast<char*>(low) + reserve);
+      isolate->SetStackLimit(data_->stack_limit);
+    }
+    data_->depth++;
+  }
+
+  ~StackLimitScope() {
+    if (data_ == nullptr) {
+      return;
+    }
+    data_->depth--;
+    if (restore_) {
+      data_->stack = saved_stack_;
+      data_->stack_limit = saved_limit_;
+      isolate_->SetStackLimit(saved_limit_);
+    }
+  }
+
+ private:
+  v8::Isolate* isolate_;
+  IsolateData* data_;
+  bool restore_;
+  void* saved_stack_;
+  uintptr_t saved_limit_;
+};
+
+typedef v8::Persistent<v8::ObjectTemplate> ObjectTemplate;
+
+// Embedder data slot of a v8::Context pointing back at its Context.
+// Slot 0 is left alone as V8 uses it internally.
+static const int kContextEmbedderIndex = 1;
+
+// Number of Values the bridge has created, for v8_Value_CreatedCount.
+std::atomic<uint64_t> values_created(0);
+
+// A persistent handed to Crystal, which releases it with v8_Value_Release.
+class Value : public v8::Persistent<v8::Value> {
+ public:
+  template <class S>
+  Value(v8::Isolate* isolate, const S& that) : v8::Persistent<v8::Value>(isolate, that) {
+    values_created.fetch_add(1, std::memory_order_relaxed);
+  }
+};
 
 String str_to_cr_str(const v8::String::Utf8Value& src) {
   char* data = static_cast<char*>(malloc(src.length()));
@@ -134,24 +430,52 @@ std::string str(v8::Local<v8::Value> value) {
   return *s;
 }
 
-std::string report_exception(v8::Isolate* isolate, v8::Local<v8::Context> ctx, v8::TryCatch& try_catch) {
+// A JS exception caught by a TryCatch. Only the thrown value and its message
+// are kept; reports and locations are built from them when asked for.
+struct CaughtException {
+  v8::Persistent<v8::Value> exception;
+  v8::Persistent<v8::Message> message;
+};
+
+ValueErrorPair caught_exception(v8::Isolate* isolate, v8::TryCatch& try_catch) {
+  CaughtException* exc = new CaughtException;
+  if (!try_catch.Exception().IsEmpty()) {
+    exc->exception.Reset(isolate, try_catch.Exception());
+  }
+  if (!try_catch.Message().IsEmpty()) {
+    exc->message.Reset(isolate, try_catch.Message());
+  }
+  return (ValueErrorPair){nullptr, {nullptr, 0}, exc};
+}
+
+v8::Local<v8::Value> exception_stack(v8::Local<v8::Context> ctx, v8::Local<v8::Value> exception) {
+  v8::Local<v8::Value> stack;
+  if (exception.IsEmpty() || !exception->IsObject() ||
+      !exception.As<v8::Object>()->Get(ctx, v8::String::NewFromUtf8(ctx->GetIsolate(), "stack")).ToLocal(&stack) ||
+      !stack->IsString()) {
+    return v8::Local<v8::Value>();
+  }
+  return stack;
+}
+
+std::string report_exception(v8::Isolate* isolate, v8::Local<v8::Context> ctx,
+                             v8::Local<v8::Value> exception, v8::Local<v8::Message> message) {
   std::stringstream ss;
   ss << "Uncaught exception: ";
 
-  std::string exceptionStr = str(try_catch.Exception());
-  ss << exceptionStr; // TODO(aroman) JSON-ify objects?
+  if (!exception.IsEmpty()) {
+    ss << str(exception); // TODO(aroman) JSON-ify objects?
+  }
 
-  //fprintf(stderr, "message is empty? %d\n", try_catch.Message().IsEmpty());
-  if (!try_catch.Message().IsEmpty()) {
-    if (!try_catch.Message()->GetScriptResourceName()->IsUndefined()) {
-      //fprintf(stderr, "res name not undefined");
+  if (!message.IsEmpty()) {
+    if (!message->GetScriptResourceName()->IsUndefined()) {
       ss << std::endl
-         << "at " << str(try_catch.Message()->GetScriptResourceName());
+         << "at " << str(message->GetScriptResourceName());
 
-      v8::Maybe<int> line_no = try_catch.Message()->GetLineNumber(ctx);
-      v8::Maybe<int> start = try_catch.Message()->GetStartColumn(ctx);
-      v8::Maybe<int> end = try_catch.Message()->GetEndColumn(ctx);
-      v8::MaybeLocal<v8::String> sourceLine = try_catch.Message()->GetSourceLine(ctx);
+      v8::Maybe<int> line_no = message->GetLineNumber(ctx);
+      v8::Maybe<int> start = message->GetStartColumn(ctx);
+      v8::Maybe<int> end = message->GetEndColumn(ctx);
+      v8::MaybeLocal<v8::String> sourceLine = message->GetSourceLine(ctx);
 
       if (line_no.IsJust()) {
         ss << ":" << line_no.ToChecked();
@@ -176,13 +500,18 @@ std::string report_exception(v8::Isolate* isolate, v8::Local<v8::Context> ctx, v
     }
   }
 
-  if (!try_catch.StackTrace().IsEmpty()) {
-    ss << std::endl << "Stack trace: " << str(try_catch.StackTrace());
+  v8::Local<v8::Value> stack = exception_stack(ctx, exception);
+  if (!stack.IsEmpty()) {
+    ss << std::endl << "Stack trace: " << str(stack);
   }
 
   return ss.str();
 }
 
+std::string report_exception(v8::Isolate* isolate, v8::Local<v8::Context> ctx, v8::TryCatch& try_catch) {
+  return report_exception(isolate, ctx, try_catch.Exception(), try_catch.Message());
+}
+
 
 extern "C" {
 
@@ -190,8 +519,14 @@ Version v8_Version() {
   return (Version){V8_MAJOR_VERSION, V8_MINOR_VERSION, V8_BUILD_NUMBER, V8_PATCH_LEVEL};
 }
 
-void v8_init() {
-  v8::Platform *platform = v8::platform::CreateDefaultPlatform();
+// Flags must be set before v8_init; V8 reads many of them only once.
+void v8_SetFlags(const char* flags) {
+  v8::V8::SetFlagsFromString(flags, int(strlen(flags)));
+}
+
+// A thread_pool_size of 0 lets V8 pick one based on the number of cores.
+void v8_init(int thread_pool_size) {
+  platform = v8::platform::CreateDefaultPlatform(thread_pool_size);
   v8::V8::InitializePlatform(platform);
   v8::V8::Initialize();
   return;
@@ -202,28 +537,61 @@ StartupData v8_CreateSnapshotDataBlob(const char* js) {
   return StartupData{data.data, data.raw_size};
 }
 
-IsolatePtr v8_Isolate_New(StartupData startup_data) {
+// Frees a blob returned by v8_CreateSnapshotDataBlob, which V8 allocates
+// with new[].
+void v8_StartupData_Release(StartupData data) {
+  delete[] data.ptr;
+}
+
+IsolateData* isolate_data(v8::Isolate* isolate) {
+  return static_cast<IsolateData*>(isolate->GetData(0));
+}
+
+IsolatePtr v8_Isolate_New(StartupData startup_data, ResourceLimits limits) {
   v8::Isolate::CreateParams create_params;
   create_params.array_buffer_allocator = &allocator;
+  if (limits.max_semi_space_size > 0) {
+    create_params.constraints.set_max_semi_space_size(limits.max_semi_space_size);
+  }
+  if (limits.max_old_space_size > 0) {
+    create_params.constraints.set_max_old_space_size(limits.max_old_space_size);
+  }
+  std::unique_ptr<v8::StartupData> snapshot;
   if (startup_data.len > 0 && startup_data.ptr != nullptr) {
-    v8::StartupData* data = new v8::StartupData;
-    data->data = startup_data.ptr;
-    data->raw_size = startup_data.len;
-    create_params.snapshot_blob = data;
+    snapshot.reset(new v8::StartupData);
+    snapshot->data = startup_data.ptr;
+    snapshot->raw_size = startup_data.len;
+    create_params.snapshot_blob = snapshot.get();
   }
-  return static_cast<IsolatePtr>(v8::Isolate::New(create_params));
+  v8::Isolate* isolate = v8::Isolate::New(create_params);
+
+  {
+    v8::Locker locker(isolate);
+    v8::Isolate::Scope isolate_scope(isolate);
+    v8::HandleScope handle_scope(isolate);
+
+    IsolateData* data = new IsolateData;
+    data->globals.Reset(isolate, v8::ObjectTemplate::New(isolate));
+    data->snapshot = std::move(snapshot);
+    isolate->SetData(0, data);
+  }
+
+  return static_cast<IsolatePtr>(isolate);
 }
-ContextPtr v8_Isolate_NewContext(IsolatePtr isolate_ptr) {
+ContextPtr v8_Isolate_NewContext(IsolatePtr isolate_ptr, const char* id) {
   ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
   v8::HandleScope handle_scope(isolate);
 
   isolate->SetCaptureStackTraceForUncaughtExceptions(true);
 
-  v8::Local<v8::ObjectTemplate> globals = v8::ObjectTemplate::New(isolate);
+  v8::Local<v8::ObjectTemplate> globals = isolate_data(isolate)->globals.Get(isolate);
 
   Context* ctx = new Context;
-  ctx->ptr.Reset(isolate, v8::Context::New(isolate, nullptr, globals));
+  v8::Local<v8::Context> context = v8::Context::New(isolate, nullptr, globals);
+  context->SetAlignedPointerInEmbedderData(kContextEmbedderIndex, ctx);
+  ctx->ptr.Reset(isolate, context);
   ctx->isolate = isolate;
+  ctx->id = id;
   return static_cast<ContextPtr>(ctx);
 }
 void v8_Isolate_Terminate(IsolatePtr isolate_ptr) {
@@ -235,36 +603,45 @@ void v8_Isolate_Release(IsolatePtr isolate_ptr) {
     return;
   }
   v8::Isolate* isolate = static_cast<v8::Isolate*>(isolate_ptr);
+  IsolateData* data = isolate_data(isolate);
+  if (data != nullptr) {
+    {
+      v8::Locker locker(isolate);
+      v8::Isolate::Scope isolate_scope(isolate);
+      for (HolderRef* ref : data->holders) {
+        release_holder(ref);
+      }
+      for (SharedBufferRef* ref : data->shared_buffers) {
+        release_shared_buffer(ref);
+      }
+      data->globals.Reset();
+    }
+    delete data;
+  }
   isolate->Dispose();
 }
 
 ValueErrorPair v8_Context_Run(ContextPtr ctxptr, const char* code, const char* filename) {
-  Context* ctx = static_cast<Context*>(ctxptr);
-  v8::Isolate* isolate = ctx->isolate;
-  v8::Locker locker(isolate);
-  v8::Isolate::Scope isolate_scope(isolate);
-  v8::HandleScope handle_scope(isolate);
-  v8::Context::Scope context_scope(ctx->ptr.Get(isolate));
+  VALUE_SCOPE(ctxptr);
   v8::TryCatch try_catch(isolate);
   try_catch.SetVerbose(false);
 
   filename = filename ? filename : "(no file)";
 
-  ValueErrorPair res = { nullptr, nullptr };
+  ValueErrorPair res = { nullptr, {nullptr, 0}, nullptr };
 
   v8::Local<v8::Script> script = v8::Script::Compile(
       v8::String::NewFromUtf8(isolate, code),
       v8::String::NewFromUtf8(isolate, filename));
 
   if (script.IsEmpty()) {
-    res.error_msg = str_to_cr_str(report_exception(isolate, ctx->ptr.Get(isolate), try_catch));
-    return res;
+    return caught_exception(isolate, try_catch);
   }
 
   v8::Local<v8::Value> result = script->Run();
 
   if (result.IsEmpty()) {
-    res.error_msg = str_to_cr_str(report_exception(isolate, ctx->ptr.Get(isolate), try_catch));
+    return caught_exception(isolate, try_catch);
   } else {
     res.Value = static_cast<PersistentValuePtr>(new Value(isolate, result));
     // res.Kinds = v8_Value_KindsFromLocal(result);
@@ -273,6 +650,190 @@ ValueErrorPair v8_Context_Run(ContextPtr ctxptr, const char* code, const char* f
 	return res;
 }
 
+ScriptStreamPtr v8_Context_StartStreaming(ContextPtr ctxptr) {
+  VALUE_SCOPE(ctxptr);
+
+  ScriptStream* stream = new ScriptStream;
+  if (stream->compiled_fds[0] < 0) {
+    delete stream;
+    return nullptr;
+  }
+  v8::ScriptCompiler::ScriptStreamingTask* task =
+    v8::ScriptCompiler::StartStreamingScript(isolate, &stream->source);
+  // The task blocks for as long as the source takes to arrive, so it must
+  // not hold up the short jobs GC and the compiler post to the pool.
+  platform->CallOnBackgroundThread(new StreamingTask(task, stream), v8::Platform::kLongRunningTask);
+  return stream;
+}
+
+void v8_ScriptStream_Push(ScriptStreamPtr streamptr, const char* data, int len) {
+  if (len <= 0) {
+    return;
+  }
+  ScriptStream* stream = static_cast<ScriptStream*>(streamptr);
+  stream->code.append(data, len);
+  stream->stream->Push(data, len);
+}
+
+void v8_ScriptStream_Finish(ScriptStreamPtr streamptr) {
+  static_cast<ScriptStream*>(streamptr)->stream->Finish();
+}
+
+// A file descriptor that becomes readable once the script is compiled. The
+// caller owns it.
+int v8_ScriptStream_CompiledFd(ScriptStreamPtr streamptr) {
+  return static_cast<ScriptStream*>(streamptr)->compiled_fds[0];
+}
+
+// Finalizes a streamed script on the isolate's thread and runs it. Must only
+// be called once v8_ScriptStream_CompiledFd is readable.
+ValueErrorPair v8_ScriptStream_Run(ContextPtr ctxptr, ScriptStreamPtr streamptr, const char* filename) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::TryCatch try_catch(isolate);
+  try_catch.SetVerbose(false);
+
+  ScriptStream* stream = static_cast<ScriptStream*>(streamptr);
+  v8::Local<v8::String> source;
+  if (!v8::String::NewFromUtf8(isolate, stream->code.data(), v8::NewStringType::kNormal,
+                               int(stream->code.length())).ToLocal(&source)) {
+    return (ValueErrorPair){nullptr, str_to_cr_str("Script is too large")};
+  }
+
+  v8::ScriptOrigin origin(v8::String::NewFromUtf8(isolate, filename ? filename : "(no file)"));
+  v8::Local<v8::Script> script;
+  if (!v8::ScriptCompiler::Compile(ctx, &stream->source, source, origin).ToLocal(&script)) {
+    return caught_exception(isolate, try_catch);
+  }
+
+  v8::Local<v8::Value> result;
+  if (!script->Run(ctx).ToLocal(&result)) {
+    return caught_exception(isolate, try_catch);
+  }
+
+  return (ValueErrorPair){new Value(isolate, result), nullptr};
+}
+
+void v8_ScriptStream_Release(ScriptStreamPtr streamptr) {
+  delete static_cast<ScriptStream*>(streamptr);
+}
+
+String __crystal_v8_module_resolver(String id, String specifier, String referrer, CallbackResult* error);
+bool throw_callback_error(v8::Isolate* iso, const CallbackResult& result);
+
+v8::MaybeLocal<v8::Module> compile_module(Context* ctx, const std::string& code, const std::string& specifier) {
+  v8::Isolate* isolate = ctx->isolate;
+  v8::Local<v8::String> source;
+  if (!v8::String::NewFromUtf8(isolate, code.data(), v8::NewStringType::kNormal,
+                               int(code.length())).ToLocal(&source)) {
+    isolate->ThrowException(v8::Exception::RangeError(
+      v8::String::NewFromUtf8(isolate, "Module source is too large")));
+    return v8::MaybeLocal<v8::Module>();
+  }
+
+  v8::ScriptOrigin origin(
+    v8::String::NewFromUtf8(isolate, specifier.c_str()),
+    v8::Local<v8::Integer>(), v8::Local<v8::Integer>(), v8::Local<v8::Boolean>(),
+    v8::Local<v8::Integer>(), v8::Local<v8::Value>(), v8::Local<v8::Boolean>(),
+    v8::Local<v8::Boolean>(), v8::True(isolate) /* is_module */);
+  v8::ScriptCompiler::Source src(source, origin);
+
+  v8::Local<v8::Module> module;
+  if (!v8::ScriptCompiler::CompileModule(isolate, &src).ToLocal(&module)) {
+    return v8::MaybeLocal<v8::Module>();
+  }
+  CompiledModule& compiled = ctx->modules[specifier];
+  compiled.module.Reset(isolate, module);
+  compiled.source = code;
+  return module;
+}
+
+// Callbacks of functions that outlived their context's release throw
+// instead of reaching a deleted Context.
+void throw_context_released(v8::Isolate* iso) {
+  iso->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(
+    iso, "Context has been released", v8::NewStringType::kNormal).ToLocalChecked()));
+}
+
+// Resolves `import` statements: modules already compiled in this context are
+// reused, anything else is fetched from Crystal and compiled on the spot.
+v8::MaybeLocal<v8::Module> resolve_module(v8::Local<v8::Context> context,
+                                          v8::Local<v8::String> specifier,
+                                          v8::Local<v8::Module> referrer) {
+  Context* ctx = static_cast<Context*>(context->GetAlignedPointerFromEmbedderData(kContextEmbedderIndex));
+  if (ctx == nullptr) {
+    throw_context_released(context->GetIsolate());
+    return v8::MaybeLocal<v8::Module>();
+  }
+  v8::Isolate* isolate = ctx->isolate;
+  std::string name = str(specifier);
+
+  auto cached = ctx->modules.find(name);
+  if (cached != ctx->modules.end()) {
+    return cached->second.module.Get(isolate);
+  }
+
+  std::string referrer_name;
+  for (auto& entry : ctx->modules) {
+    if (entry.second.module == referrer) {
+      referrer_name = entry.first;
+      break;
+    }
+  }
+
+  CallbackResult error = {nullptr, {nullptr, 0}, nullptr};
+  String source = __crystal_v8_module_resolver(
+    (String){ctx->id.data(), int(ctx->id.length())},
+    (String){name.data(), int(name.length())},
+    (String){referrer_name.data(), int(referrer_name.length())},
+    &error);
+
+  if (throw_callback_error(isolate, error)) {
+    return v8::MaybeLocal<v8::Module>();
+  }
+  if (source.ptr == nullptr) {
+    std::string msg = "Cannot resolve module '" + name + "'";
+    isolate->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(isolate, msg.c_str())));
+    return v8::MaybeLocal<v8::Module>();
+  }
+
+  return compile_module(ctx, std::string(source.ptr, source.len), name);
+}
+
+ValueErrorPair v8_Context_RunModule(ContextPtr ctxptr, const char* code, const char* specifier) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::TryCatch try_catch(isolate);
+  try_catch.SetVerbose(false);
+
+  Context* context = static_cast<Context*>(ctxptr);
+  v8::Local<v8::Module> module;
+
+  auto cached = context->modules.find(specifier);
+  if (cached != context->modules.end() && cached->second.source == code) {
+    module = cached->second.module.Get(isolate);
+  } else {
+    if (cached != context->modules.end()) {
+      context->modules.erase(cached);
+    }
+    if (!compile_module(context, code, specifier).ToLocal(&module)) {
+      return caught_exception(isolate, try_catch);
+    }
+  }
+
+  if (module->GetStatus() == v8::Module::kUninstantiated &&
+      !module->InstantiateModule(ctx, resolve_module).FromMaybe(false)) {
+    return caught_exception(isolate, try_catch);
+  }
+
+  v8::Local<v8::Value> result;
+  if (!module->Evaluate(ctx).ToLocal(&result)) {
+    return caught_exception(isolate, try_catch);
+  }
+
+  return (ValueErrorPair){new Value(isolate, result), nullptr};
+}
+
 void crystal_callback(const v8::FunctionCallbackInfo<v8::Value>& args);
 
 PersistentValuePtr v8_FunctionTemplate_New(ContextPtr ctxptr, const char* name, const char* id) {
@@ -286,12 +847,279 @@ PersistentValuePtr v8_FunctionTemplate_New(ContextPtr ctxptr, const char* name,
   return new Value(isolate, cb->GetFunction());
 }
 
-PersistentValuePtr __crystal_v8_callback_handler(String id, int argc, PersistentValuePtr* argv);
+ObjectTemplatePtr v8_Isolate_GlobalTemplate(IsolatePtr isolate_ptr) {
+  ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
+  return new ObjectTemplate(isolate, isolate_data(isolate)->globals);
+}
+
+ObjectTemplatePtr v8_ObjectTemplate_New(IsolatePtr isolate_ptr) {
+  ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
+  v8::HandleScope handle_scope(isolate);
+
+  v8::Local<v8::ObjectTemplate> tmpl = v8::ObjectTemplate::New(isolate);
+  tmpl->SetInternalFieldCount(1);  // Holds the Crystal object, see v8_ObjectTemplate_NewInstance.
+  return new ObjectTemplate(isolate, tmpl);
+}
+
+void v8_ObjectTemplate_SetFunction(IsolatePtr isolate_ptr, ObjectTemplatePtr tmplptr,
+                                   const char* name, const char* id) {
+  ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
+  v8::HandleScope handle_scope(isolate);
+
+  v8::Local<v8::FunctionTemplate> cb = v8::FunctionTemplate::New(
+    isolate,
+    crystal_callback,
+    v8::String::NewFromUtf8(isolate, id)
+  );
+  cb->SetClassName(v8::String::NewFromUtf8(isolate, name));
+
+  static_cast<ObjectTemplate*>(tmplptr)->Get(isolate)->Set(
+    v8::String::NewFromUtf8(isolate, name), cb);
+}
+
+void v8_ObjectTemplate_SetTemplate(IsolatePtr isolate_ptr, ObjectTemplatePtr tmplptr,
+                                   const char* name, ObjectTemplatePtr valueptr) {
+  ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
+  v8::HandleScope handle_scope(isolate);
+
+  static_cast<ObjectTemplate*>(tmplptr)->Get(isolate)->Set(
+    v8::String::NewFromUtf8(isolate, name),
+    static_cast<ObjectTemplate*>(valueptr)->Get(isolate));
+}
+
+void crystal_accessor(v8::Local<v8::String> property, const v8::PropertyCallbackInfo<v8::Value>& info);
+void crystal_named_property(v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Value>& info);
+void crystal_indexed_property(uint32_t index, const v8::PropertyCallbackInfo<v8::Value>& info);
+
+void v8_ObjectTemplate_SetAccessor(IsolatePtr isolate_ptr, ObjectTemplatePtr tmplptr,
+                                   const char* name, const char* id) {
+  ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
+  v8::HandleScope handle_scope(isolate);
+
+  static_cast<ObjectTemplate*>(tmplptr)->Get(isolate)->SetAccessor(
+    v8::String::NewFromUtf8(isolate, name),
+    crystal_accessor,
+    nullptr,
+    v8::String::NewFromUtf8(isolate, id));
+}
+
+void v8_ObjectTemplate_SetNamedHandler(IsolatePtr isolate_ptr, ObjectTemplatePtr tmplptr, const char* id) {
+  ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
+  v8::HandleScope handle_scope(isolate);
+
+  static_cast<ObjectTemplate*>(tmplptr)->Get(isolate)->SetHandler(
+    v8::NamedPropertyHandlerConfiguration(
+      crystal_named_property, nullptr, nullptr, nullptr, nullptr,
+      v8::String::NewFromUtf8(isolate, id)));
+}
+
+void v8_ObjectTemplate_SetIndexedHandler(IsolatePtr isolate_ptr, ObjectTemplatePtr tmplptr, const char* id) {
+  ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
+  v8::HandleScope handle_scope(isolate);
+
+  static_cast<ObjectTemplate*>(tmplptr)->Get(isolate)->SetHandler(
+    v8::IndexedPropertyHandlerConfiguration(
+      crystal_indexed_property, nullptr, nullptr, nullptr, nullptr,
+      v8::String::NewFromUtf8(isolate, id)));
+}
+
+PersistentValuePtr v8_ObjectTemplate_NewInstance(ContextPtr ctxptr, ObjectTemplatePtr tmplptr, void* holder) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::Local<v8::Object> obj;
+  if (!static_cast<ObjectTemplate*>(tmplptr)->Get(isolate)->NewInstance(ctx).ToLocal(&obj)) {
+    return nullptr;
+  }
+  if (obj->InternalFieldCount() > 0) {
+    // Always written, so callbacks never mistake garbage for a holder.
+    obj->SetAlignedPointerInInternalField(0, holder);
+  }
+  if (holder != nullptr) {
+    HolderRef* ref = new HolderRef;
+    ref->holder = holder;
+    ref->handle.Reset(isolate, obj);
+    ref->handle.SetWeak(ref, holder_collected, v8::WeakCallbackType::kParameter);
+    isolate_data(isolate)->holders.insert(ref);
+  }
+  return new Value(isolate, obj);
+}
+
+void v8_ObjectTemplate_Release(IsolatePtr isolate_ptr, ObjectTemplatePtr tmplptr) {
+  if (isolate_ptr == nullptr || tmplptr == nullptr) {
+    return;
+  }
+
+  ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
+
+  ObjectTemplate* tmpl = static_cast<ObjectTemplate*>(tmplptr);
+  tmpl->Reset();
+  delete tmpl;
+}
+
+// Bindings may come from the isolate's global template, so the context is
+// whichever one is calling rather than one baked into the callback data.
+Context* current_context(v8::Isolate* iso) {
+  return static_cast<Context*>(
+    iso->GetCurrentContext()->GetAlignedPointerFromEmbedderData(kContextEmbedderIndex));
+}
+
+CallbackResult __crystal_v8_property_handler(String ctx_id, String id, void* holder, String name, uint32_t index);
+
+// Throws whatever a Crystal callback raised and returns true, or returns
+// false if it finished normally.
+bool throw_callback_error(v8::Isolate* iso, const CallbackResult& result) {
+  if (result.Exception != nullptr) {
+    CaughtException* exc = static_cast<CaughtException*>(result.Exception);
+    iso->ThrowException(exc->exception.IsEmpty()
+      ? v8::Local<v8::Value>(v8::Undefined(iso)) : exc->exception.Get(iso));
+    return true;
+  }
+  if (result.error_msg.ptr != nullptr) {
+    iso->ThrowException(v8::Exception::Error(v8::String::NewFromUtf8(
+      iso, result.error_msg.ptr, v8::NewStringType::kNormal, result.error_msg.len).ToLocalChecked()));
+    return true;
+  }
+  return false;
+}
+
+void crystal_property(const std::string& name, uint32_t index, const v8::PropertyCallbackInfo<v8::Value>& info) {
+  v8::Isolate* iso = info.GetIsolate();
+  v8::HandleScope scope(iso);
+
+  Context* ctx = current_context(iso);
+  if (ctx == nullptr) {
+    throw_context_released(iso);
+    return;
+  }
+  std::string id = str(info.Data());
+
+  v8::Local<v8::Object> holder = info.Holder();
+  void* holder_ptr = holder->InternalFieldCount() > 0 ? holder->GetAlignedPointerFromInternalField(0) : nullptr;
+
+  CallbackResult result = __crystal_v8_property_handler(
+    (String){ctx->id.data(), int(ctx->id.length())},
+    (String){id.data(), int(id.length())},
+    holder_ptr,
+    (String){name.data(), int(name.length())},
+    index);
+
+  // Leaving the return value unset lets interceptors fall through to the
+  // object's own properties.
+  if (!throw_callback_error(iso, result) && result.Value != nullptr) {
+    info.GetReturnValue().Set(*static_cast<Value*>(result.Value));
+  }
+}
+
+void crystal_accessor(v8::Local<v8::String> property, const v8::PropertyCallbackInfo<v8::Value>& info) {
+  crystal_property(str(property), 0, info);
+}
+
+void crystal_named_property(v8::Local<v8::Name> property, const v8::PropertyCallbackInfo<v8::Value>& info) {
+  if (!property->IsString()) {
+    return;  // Symbols are never intercepted.
+  }
+  crystal_property(str(property), 0, info);
+}
+
+void crystal_indexed_property(uint32_t index, const v8::PropertyCallbackInfo<v8::Value>& info) {
+  crystal_property(std::string(), index, info);
+}
+
+CallbackResult __crystal_v8_typed_callback_handler(void* data, TypedValue* argv, TypedValue* result);
+
+// Unpacks arguments straight into native values and writes the result back
+// through the return value, so a call allocates neither persistents nor
+// Crystal values.
+void typed_callback(const v8::FunctionCallbackInfo<v8::Value>& args) {
+  v8::Isolate* iso = args.GetIsolate();
+  // The TypedCallback is owned by the Context.
+  if (current_context(iso) == nullptr) {
+    throw_context_released(iso);
+    return;
+  }
+  v8::Local<v8::Context> ctx = iso->GetCurrentContext();
+  TypedCallback* cb = static_cast<TypedCallback*>(v8::Local<v8::External>::Cast(args.Data())->Value());
+
+  TypedValue argv[kMaxTypedArgs];
+  for (size_t i = 0; i < cb->args.length(); i++) {
+    v8::Local<v8::Value> arg = args[i];
+    switch (cb->args[i]) {
+      case 'd': {
+        if (arg->IsNumber()) {
+          argv[i].Float64 = arg.As<v8::Number>()->Value();
+        } else if (!arg->NumberValue(ctx).To(&argv[i].Float64)) {
+          return;
+        }
+      } break;
+      case 'i': {
+        if (arg->IsInt32()) {
+          argv[i].Int32 = arg.As<v8::Int32>()->Value();
+        } else if (!arg->Int32Value(ctx).To(&argv[i].Int32)) {
+          return;
+        }
+      } break;
+      case 'u': {
+        if (arg->IsUint32()) {
+          argv[i].Uint32 = arg.As<v8::Uint32>()->Value();
+        } else if (!arg->Uint32Value(ctx).To(&argv[i].Uint32)) {
+          return;
+        }
+      } break;
+      case 'b': {
+        bool b;
+        if (!arg->BooleanValue(ctx).To(&b)) {
+          return;
+        }
+        argv[i].Bool = b ? 1 : 0;
+      } break;
+    }
+  }
+
+  TypedValue result;
+  if (throw_callback_error(iso, __crystal_v8_typed_callback_handler(cb->data, argv, &result))) {
+    return;
+  }
+
+  switch (cb->result) {
+    case 'd': args.GetReturnValue().Set(result.Float64);     break;
+    case 'i': args.GetReturnValue().Set(result.Int32);       break;
+    case 'u': args.GetReturnValue().Set(result.Uint32);      break;
+    case 'b': args.GetReturnValue().Set(result.Bool != 0);   break;
+  }
+}
+
+void v8_Context_BindTyped(ContextPtr ctxptr, const char* name, const char* signature, void* data) {
+  VALUE_SCOPE(ctxptr);
+
+  Context* context = static_cast<Context*>(ctxptr);
+  std::string sig(signature);
+
+  TypedCallback* cb = new TypedCallback;
+  cb->args = sig.substr(0, sig.length() - 1);
+  cb->result = sig[sig.length() - 1];
+  cb->data = data;
+  context->typed_callbacks.emplace_back(cb);
+
+  v8::Local<v8::FunctionTemplate> tmpl = v8::FunctionTemplate::New(
+    isolate, typed_callback, v8::External::New(isolate, cb), v8::Local<v8::Signature>(),
+    int(cb->args.length()));
+  v8::Local<v8::String> fn_name = v8::String::NewFromUtf8(isolate, name);
+  tmpl->SetClassName(fn_name);
+
+  ctx->Global()->Set(ctx, fn_name, tmpl->GetFunction(ctx).ToLocalChecked()).FromJust();
+}
+
+CallbackResult __crystal_v8_callback_handler(String ctx_id, String id, int argc, PersistentValuePtr* argv);
 
 void crystal_callback(const v8::FunctionCallbackInfo<v8::Value>& args) {
   v8::Isolate* iso = args.GetIsolate();
   v8::HandleScope scope(iso);
 
+  Context* ctx = current_context(iso);
+  if (ctx == nullptr) {
+    throw_context_released(iso);
+    return;
+  }
   std::string id = str(args.Data());
 
   std::string src_file, src_func;
@@ -313,25 +1141,20 @@ void crystal_callback(const v8::FunctionCallbackInfo<v8::Value>& args) {
   }
   //fprintf(stderr, "sizeof argv %lu\n", sizeof(argv));
 
-  PersistentValuePtr result = __crystal_v8_callback_handler((String){id.data(), int(id.length())}, argc, argv);
+  CallbackResult result = __crystal_v8_callback_handler(
+    (String){ctx->id.data(), int(ctx->id.length())},
+    (String){id.data(), int(id.length())},
+    argc, argv);
 
   //fprintf(stderr, "done with crystal cb\n");
 
-  if (result == nullptr) {
+  if (throw_callback_error(iso, result)) {
+    return;
+  } else if (result.Value == nullptr) {
     args.GetReturnValue().Set(v8::Undefined(iso));
   } else {
-    args.GetReturnValue().Set(*static_cast<Value*>(result));
+    args.GetReturnValue().Set(*static_cast<Value*>(result.Value));
   }
-
-  // if (result.error_msg.ptr != nullptr) {
-  //   v8::Local<v8::Value> err = v8::Exception::Error(
-  //     v8::String::NewFromUtf8(isolate, result.error_msg.ptr, v8::NewStringType::kNormal, result.error_msg.len).ToLocalChecked());
-  //   isolate->ThrowException(err);
-  // } else if (result.Value == NULL) {
-  //   args.GetReturnValue().Set(v8::Undefined(isolate));
-  // } else {
-  //   args.GetReturnValue().Set(*static_cast<Value*>(result.Value));
-  // }
 }
 
 // void go_callback(const v8::FunctionCallbackInfo<v8::Value>& args) {
@@ -391,28 +1214,79 @@ void v8_Context_Release(ContextPtr ctxptr) {
   }
   Context* ctx = static_cast<Context*>(ctxptr);
   ISOLATE_SCOPE(ctx->isolate);
+  v8::HandleScope handle_scope(isolate);
+  // Functions from this context can still be reached from other contexts
+  // of the isolate; their callbacks check for this.
+  ctx->ptr.Get(isolate)->SetAlignedPointerInEmbedderData(kContextEmbedderIndex, nullptr);
+  for (auto& detached : ctx->detached) {
+    if (!detached.IsEmpty()) {
+      detached.Get(isolate)->SetAlignedPointerInEmbedderData(kContextEmbedderIndex, nullptr);
+    }
+  }
+  ctx->modules.clear();
   ctx->ptr.Reset();
+  delete ctx;
 }
 
-PersistentValuePtr v8_Context_Create(ContextPtr ctxptr, ImmediateValue val) {
-  VALUE_SCOPE(ctxptr);
+// Swaps in a pristine v8::Context behind the same global proxy. The old
+// context's global is detached and handed to the new one, so only the proxy's
+// identity survives; with a startup snapshot the new context is deserialized
+// rather than bootstrapped from scratch.
+void v8_Context_Reset(ContextPtr ctxptr) {
+  Context* ctx = static_cast<Context*>(ctxptr);
+  ISOLATE_SCOPE(ctx->isolate);
+  v8::HandleScope handle_scope(isolate);
+
+  v8::Local<v8::Context> old_context = ctx->ptr.Get(isolate);
+  v8::Local<v8::Object> global = old_context->Global();
+  old_context->DetachGlobal();
+
+  // Closures from the old context keep calling back into ctx, so it is
+  // remembered until collected to be cleared on release.
+  ctx->detached.erase(
+    std::remove_if(ctx->detached.begin(), ctx->detached.end(),
+                   [](const v8::Global<v8::Context>& c) { return c.IsEmpty(); }),
+    ctx->detached.end());
+  ctx->detached.emplace_back(isolate, old_context);
+  ctx->detached.back().SetWeak();
+
+  v8::Local<v8::Context> context = v8::Context::New(
+    isolate, nullptr, isolate_data(isolate)->globals.Get(isolate), global);
+  context->SetAlignedPointerInEmbedderData(kContextEmbedderIndex, ctx);
+
+  ctx->modules.clear();
+  ctx->ptr.Reset(isolate, context);
+}
 
+v8::Local<v8::Value> immediate_to_local(v8::Isolate* isolate, const ImmediateValue& val) {
   switch (val.Type) {
     case tSTRING:
-      return new Value(isolate, v8::String::NewFromUtf8(
-        isolate, val.Str.ptr, v8::NewStringType::kNormal, val.Str.len).ToLocalChecked());
-    case tNUMBER:      return new Value(isolate, v8::Number::New(isolate, val.Num));                    break;
-    case tBOOL:        return new Value(isolate, v8::Boolean::New(isolate, val.BoolVal == 1));          break;
-    case tOBJECT:      return new Value(isolate, v8::Object::New(isolate));                             break;
-    case tARRAY:       return new Value(isolate, v8::Array::New(isolate, val.Len));                     break;
+      return v8::String::NewFromUtf8(
+        isolate, val.Str.ptr, v8::NewStringType::kNormal, val.Str.len).ToLocalChecked();
+    case tNUMBER:      return v8::Number::New(isolate, val.Num);                    break;
+    case tBOOL:        return v8::Boolean::New(isolate, val.BoolVal == 1);          break;
+    case tOBJECT:      return v8::Object::New(isolate);                             break;
+    case tARRAY:       return v8::Array::New(isolate, val.Len);                     break;
     case tARRAYBUFFER: {
         v8::Local<v8::ArrayBuffer> buf = v8::ArrayBuffer::New(isolate, val.Len);
         memcpy(buf->GetContents().Data(), val.Bytes, val.Len);
-        return new Value(isolate, buf);
+        return buf;
     } break;
-    case tUNDEFINED:   return new Value(isolate, v8::Undefined(isolate));                               break;
+    case tUNDEFINED:   return v8::Undefined(isolate);                               break;
+    case tNULL:        return v8::Null(isolate);                                    break;
+    case tVALUE:       return static_cast<Value*>(val.Value)->Get(isolate);        break;
   }
-  return nullptr;
+  return v8::Local<v8::Value>();
+}
+
+PersistentValuePtr v8_Context_Create(ContextPtr ctxptr, ImmediateValue val) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::Local<v8::Value> value = immediate_to_local(isolate, val);
+  if (value.IsEmpty()) {
+    return nullptr;
+  }
+  return new Value(isolate, value);
 }
 
 ValueErrorPair v8_Value_Get(ContextPtr ctxptr, PersistentValuePtr valueptr, const char* field) {
@@ -428,11 +1302,65 @@ ValueErrorPair v8_Value_Get(ContextPtr ctxptr, PersistentValuePtr valueptr, cons
   // we've just created the local object above.
   v8::Local<v8::Object> object = maybeObject->ToObject(ctx).ToLocalChecked();
 
-  v8::Local<v8::Value> localValue = object->Get(ctx, v8::String::NewFromUtf8(isolate, field)).ToLocalChecked();
+  v8::TryCatch try_catch(isolate);
+  try_catch.SetVerbose(false);
+
+  v8::Local<v8::Value> localValue;
+  if (!object->Get(ctx, v8::String::NewFromUtf8(isolate, field)).ToLocal(&localValue)) {
+    return caught_exception(isolate, try_catch);
+  }
 
   return (ValueErrorPair){new Value(isolate, localValue), nullptr};
 }
 
+ValueErrorPair v8_Context_ParseJSON(ContextPtr ctxptr, const char* json, int len) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::TryCatch try_catch(isolate);
+  try_catch.SetVerbose(false);
+
+  v8::Local<v8::String> source;
+  if (!v8::String::NewFromUtf8(isolate, json, v8::NewStringType::kNormal, len).ToLocal(&source)) {
+    return (ValueErrorPair){nullptr, str_to_cr_str("JSON input is too large")};
+  }
+
+  v8::Local<v8::Value> result;
+  if (!v8::JSON::Parse(ctx, source).ToLocal(&result)) {
+    return caught_exception(isolate, try_catch);
+  }
+
+  return (ValueErrorPair){new Value(isolate, result), nullptr};
+}
+
+StringErrorPair v8_Value_Stringify(ContextPtr ctxptr, PersistentValuePtr valueptr, char* out, int capacity) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::TryCatch try_catch(isolate);
+  try_catch.SetVerbose(false);
+
+  v8::Local<v8::Value> value = static_cast<Value*>(valueptr)->Get(isolate);
+  v8::Local<v8::String> json;
+  if (!v8::JSON::Stringify(ctx, value).ToLocal(&json)) {
+    ValueErrorPair caught = caught_exception(isolate, try_catch);
+    return (StringErrorPair){{nullptr, 0}, {nullptr, 0}, caught.Exception};
+  }
+
+  // Values JSON can't represent (undefined, functions, symbols) come back as
+  // the bare word "undefined", which no valid JSON text is. Report them as a
+  // null string instead.
+  if (json->StrictEquals(v8::String::NewFromUtf8(isolate, "undefined"))) {
+    return (StringErrorPair){{nullptr, 0}, {nullptr, 0}, nullptr};
+  }
+
+  // The output goes into the caller's buffer when it fits, and into a fresh
+  // allocation the caller frees otherwise.
+  int length = json->Utf8Length();
+  char* data = length <= capacity ? out : static_cast<char*>(malloc(length));
+  json->WriteUtf8(data, length, nullptr, v8::String::NO_NULL_TERMINATION);
+
+  return (StringErrorPair){{data, length}, {nullptr, 0}, nullptr};
+}
+
 ValueTuple v8_Value_GetIdx(ContextPtr ctxptr, PersistentValuePtr valueptr, int idx) {
   VALUE_SCOPE(ctxptr);
 
@@ -459,6 +1387,101 @@ ValueTuple v8_Value_GetIdx(ContextPtr ctxptr, PersistentValuePtr valueptr, int i
   return (ValueTuple){new Value(isolate, obj), v8_Value_KindsFromLocal(obj), nullptr};
 }
 
+// Copies up to `capacity` numbers out of an array and returns its length, or
+// -1 if the value is not an array. Float64Arrays are copied in one go. The
+// public API has no way to reach a plain array's backing store, so those,
+// packed doubles included, are read element by element, though without
+// creating any persistents.
+int v8_Array_CopyFloat64(ContextPtr ctxptr, PersistentValuePtr valueptr, double* out, int capacity) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::Local<v8::Value> value = static_cast<Value*>(valueptr)->Get(isolate);
+
+  if (value->IsFloat64Array()) {
+    v8::Local<v8::Float64Array> typed = value.As<v8::Float64Array>();
+    int length = int(typed->Length());
+    int n = length < capacity ? length : capacity;
+    typed->CopyContents(out, n * sizeof(double));
+    return length;
+  }
+
+  if (!value->IsArray() && !value->IsTypedArray()) {
+    return -1;
+  }
+
+  v8::Local<v8::Object> array = value.As<v8::Object>();
+  int length = value->IsArray()
+    ? int(value.As<v8::Array>()->Length())
+    : int(value.As<v8::TypedArray>()->Length());
+  int n = length < capacity ? length : capacity;
+
+  for (int i = 0; i < n; i++) {
+    v8::HandleScope element_scope(isolate);
+    v8::Local<v8::Value> element;
+    if (!array->Get(ctx, uint32_t(i)).ToLocal(&element)) {
+      out[i] = std::numeric_limits<double>::quiet_NaN();
+    } else if (element->IsNumber()) {
+      out[i] = element.As<v8::Number>()->Value();
+    } else {
+      out[i] = element->NumberValue(ctx).FromMaybe(std::numeric_limits<double>::quiet_NaN());
+    }
+  }
+
+  return length;
+}
+
+// Fills `out` with persistents for up to `count` elements starting at
+// `start` and returns how many were written, or -1 if the value is not an
+// array.
+int v8_Array_GetRange(ContextPtr ctxptr, PersistentValuePtr valueptr,
+                      int start, int count, PersistentValuePtr* out) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::Local<v8::Value> value = static_cast<Value*>(valueptr)->Get(isolate);
+  if (!value->IsArray()) {
+    return -1;
+  }
+
+  v8::Local<v8::Array> array = value.As<v8::Array>();
+  int length = int(array->Length());
+  int n = 0;
+
+  for (int i = start; i < length && n < count; i++, n++) {
+    v8::HandleScope element_scope(isolate);
+    v8::Local<v8::Value> element;
+    if (!array->Get(ctx, uint32_t(i)).ToLocal(&element)) {
+      element = v8::Undefined(isolate);
+    }
+    out[n] = new Value(isolate, element);
+  }
+
+  return n;
+}
+
+PersistentValuePtr v8_Array_NewFloat64(ContextPtr ctxptr, const double* values, int len) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::Local<v8::Array> array = v8::Array::New(isolate, len);
+  for (int i = 0; i < len; i++) {
+    v8::HandleScope element_scope(isolate);
+    array->Set(ctx, uint32_t(i), v8::Number::New(isolate, values[i])).FromMaybe(false);
+  }
+
+  return new Value(isolate, array);
+}
+
+PersistentValuePtr v8_Array_NewImmediate(ContextPtr ctxptr, ImmediateValue* values, int len) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::Local<v8::Array> array = v8::Array::New(isolate, len);
+  for (int i = 0; i < len; i++) {
+    v8::HandleScope element_scope(isolate);
+    array->Set(ctx, uint32_t(i), immediate_to_local(isolate, values[i])).FromMaybe(false);
+  }
+
+  return new Value(isolate, array);
+}
+
 Error v8_Value_Set(ContextPtr ctxptr, PersistentValuePtr valueptr,
                    const char* field, PersistentValuePtr new_valueptr) {
   VALUE_SCOPE(ctxptr);
@@ -556,21 +1579,19 @@ ValueErrorPair v8_Function_Call(ContextPtr ctxptr,
   }
   //fprintf(stderr, "call: got this value\n");
 
-  v8::Local<v8::Value>* argv = new v8::Local<v8::Value>[argc];
+  Argv argv(argc);
   for (int i = 0; i < argc; i++) {
     //fprintf(stderr, "call: trying to assign something\n");
     argv[i] = static_cast<Value*>(argvptr[i])->Get(isolate);
   }
   //fprintf(stderr, "call: made argv length: %d %p %p\n", argc, argvptr, argv);
 
-  v8::MaybeLocal<v8::Value> result = func->Call(ctx, self, argc, argv);
+  v8::MaybeLocal<v8::Value> result = func->Call(ctx, self, argc, argv.get());
   //fprintf(stderr, "call: got maybe res\n");
 
-  delete[] argv;
-
   if (result.IsEmpty()) {
     //fprintf(stderr, "call: is empty :(\n");
-    return (ValueErrorPair){nullptr, str_to_cr_str(report_exception(isolate, ctx, try_catch))};
+    return caught_exception(isolate, try_catch);
   }
 
   v8::Local<v8::Value> value = result.ToLocalChecked();
@@ -581,6 +1602,63 @@ ValueErrorPair v8_Function_Call(ContextPtr ctxptr,
   };
 }
 
+// Like v8_Function_Call, but primitive arguments are passed by value instead
+// of through persistents created for the call.
+ValueErrorPair v8_Function_CallImmediate(ContextPtr ctxptr,
+                                         PersistentValuePtr funcptr,
+                                         ImmediateValue self,
+                                         int argc, ImmediateValue* argvptr) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::TryCatch try_catch(isolate);
+  try_catch.SetVerbose(false);
+
+  v8::Local<v8::Value> func_val = static_cast<Value*>(funcptr)->Get(isolate);
+  if (!func_val->IsFunction()) {
+    return (ValueErrorPair){nullptr, str_to_cr_str("Not a function")};
+  }
+  v8::Local<v8::Function> func = v8::Local<v8::Function>::Cast(func_val);
+
+  Argv argv(argc);
+  for (int i = 0; i < argc; i++) {
+    argv[i] = immediate_to_local(isolate, argvptr[i]);
+  }
+
+  v8::Local<v8::Value> result;
+  if (!func->Call(ctx, immediate_to_local(isolate, self), argc, argv.get()).ToLocal(&result)) {
+    return caught_exception(isolate, try_catch);
+  }
+
+  return (ValueErrorPair){new Value(isolate, result), nullptr};
+}
+
+ValueErrorPair v8_Function_NewImmediate(ContextPtr ctxptr,
+                                        PersistentValuePtr funcptr,
+                                        int argc, ImmediateValue* argvptr) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::TryCatch try_catch(isolate);
+  try_catch.SetVerbose(false);
+
+  v8::Local<v8::Value> func_val = static_cast<Value*>(funcptr)->Get(isolate);
+  if (!func_val->IsFunction()) {
+    return (ValueErrorPair){nullptr, str_to_cr_str("Not a function")};
+  }
+  v8::Local<v8::Function> func = v8::Local<v8::Function>::Cast(func_val);
+
+  Argv argv(argc);
+  for (int i = 0; i < argc; i++) {
+    argv[i] = immediate_to_local(isolate, argvptr[i]);
+  }
+
+  v8::Local<v8::Object> result;
+  if (!func->NewInstance(ctx, argc, argv.get()).ToLocal(&result)) {
+    return caught_exception(isolate, try_catch);
+  }
+
+  return (ValueErrorPair){new Value(isolate, result), nullptr};
+}
+
 PersistentValuePtr v8_Object_New(ContextPtr ctxptr) {
   VALUE_SCOPE(ctxptr);
   v8::Local<v8::Object> obj = v8::Object::New(isolate);
@@ -607,14 +1685,12 @@ ValueTuple v8_Value_New(ContextPtr ctxptr,
   }
   v8::Local<v8::Function> func = v8::Local<v8::Function>::Cast(func_val);
 
-  v8::Local<v8::Value>* argv = new v8::Local<v8::Value>[argc];
+  Argv argv(argc);
   for (int i = 0; i < argc; i++) {
     argv[i] = static_cast<Value*>(argvptr[i])->Get(isolate);
   }
 
-  v8::MaybeLocal<v8::Object> result = func->NewInstance(ctx, argc, argv);
-
-  delete[] argv;
+  v8::MaybeLocal<v8::Object> result = func->NewInstance(ctx, argc, argv.get());
 
   if (result.IsEmpty()) {
     return (ValueTuple){nullptr, nullptr, 0, str_to_cr_str(report_exception(isolate, ctx, try_catch))};
@@ -628,12 +1704,80 @@ ValueTuple v8_Value_New(ContextPtr ctxptr,
   };
 }
 
-void v8_Value_Release(ContextPtr ctxptr, PersistentValuePtr valueptr) {
-  if (valueptr == nullptr || ctxptr == nullptr)  {
+PersistentValuePtr v8_Exception_Value(ContextPtr ctxptr, ExceptionPtr excptr) {
+  VALUE_SCOPE(ctxptr);
+
+  CaughtException* exc = static_cast<CaughtException*>(excptr);
+  if (exc->exception.IsEmpty()) {
+    return new Value(isolate, v8::Undefined(isolate));
+  }
+  return new Value(isolate, exc->exception.Get(isolate));
+}
+
+String v8_Exception_Report(ContextPtr ctxptr, ExceptionPtr excptr) {
+  VALUE_SCOPE(ctxptr);
+
+  CaughtException* exc = static_cast<CaughtException*>(excptr);
+  return str_to_cr_str(report_exception(isolate, ctx,
+    exc->exception.Get(isolate), exc->message.Get(isolate)));
+}
+
+// Returns the exception's `stack` property, or a null string if there is
+// none (e.g. when a primitive was thrown).
+String v8_Exception_Stack(ContextPtr ctxptr, ExceptionPtr excptr) {
+  VALUE_SCOPE(ctxptr);
+
+  CaughtException* exc = static_cast<CaughtException*>(excptr);
+  v8::Local<v8::Value> stack = exception_stack(ctx, exc->exception.Get(isolate));
+  if (stack.IsEmpty()) {
+    return (String){nullptr, 0};
+  }
+  return str_to_cr_str(stack);
+}
+
+CallerInfo v8_Exception_Location(ContextPtr ctxptr, ExceptionPtr excptr) {
+  VALUE_SCOPE(ctxptr);
+
+  CallerInfo info = {{nullptr, 0}, {nullptr, 0}, 0, 0};
+  CaughtException* exc = static_cast<CaughtException*>(excptr);
+  if (exc->message.IsEmpty()) {
+    return info;
+  }
+
+  v8::Local<v8::Message> message = exc->message.Get(isolate);
+  v8::Local<v8::StackTrace> trace = message->GetStackTrace();
+  if (!trace.IsEmpty() && trace->GetFrameCount() > 0) {
+    info.Funcname = str_to_cr_str(str(trace->GetFrame(0)->GetFunctionName()));
+  }
+  info.Filename = str_to_cr_str(str(message->GetScriptResourceName()));
+  info.Line = message->GetLineNumber(ctx).FromMaybe(0);
+  info.Column = message->GetStartColumn(ctx).FromMaybe(0);
+  return info;
+}
+
+void v8_Exception_Release(IsolatePtr isolate_ptr, ExceptionPtr excptr) {
+  if (excptr == nullptr || isolate_ptr == nullptr) {
+    return;
+  }
+
+  ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
+
+  CaughtException* exc = static_cast<CaughtException*>(excptr);
+  exc->exception.Reset();
+  exc->message.Reset();
+  delete exc;
+}
+
+uint64_t v8_Value_CreatedCount() {
+  return values_created.load(std::memory_order_relaxed);
+}
+
+void v8_Value_Release(IsolatePtr isolate_ptr, PersistentValuePtr valueptr) {
+  if (valueptr == nullptr || isolate_ptr == nullptr)  {
     return;
   }
 
-  ISOLATE_SCOPE(static_cast<Context*>(ctxptr)->isolate);
+  ISOLATE_SCOPE(static_cast<v8::Isolate*>(isolate_ptr));
 
   Value* value = static_cast<Value*>(valueptr);
   value->Reset();
@@ -740,6 +1884,150 @@ void v8_Isolate_LowMemoryNotification(IsolatePtr isolate_ptr) {
   isolate->LowMemoryNotification();
 }
 
+SharedBackingPtr v8_SharedBacking_New(size_t len) {
+  return new SharedBacking(len);
+}
+
+void* v8_SharedBacking_Data(SharedBackingPtr backingptr) {
+  return static_cast<SharedBacking*>(backingptr)->data;
+}
+
+void v8_SharedBacking_Release(SharedBackingPtr backingptr) {
+  if (backingptr == nullptr) {
+    return;
+  }
+  static_cast<SharedBacking*>(backingptr)->Release();
+}
+
+// Sequentially consistent Int32 operations, matching what JS Atomics does on
+// an Int32Array over the same memory.
+int32_t v8_SharedBacking_Load(SharedBackingPtr backingptr, size_t index) {
+  return __atomic_load_n(static_cast<SharedBacking*>(backingptr)->Int32At(index), __ATOMIC_SEQ_CST);
+}
+
+void v8_SharedBacking_Store(SharedBackingPtr backingptr, size_t index, int32_t value) {
+  __atomic_store_n(static_cast<SharedBacking*>(backingptr)->Int32At(index), value, __ATOMIC_SEQ_CST);
+}
+
+int32_t v8_SharedBacking_Add(SharedBackingPtr backingptr, size_t index, int32_t value) {
+  return __atomic_fetch_add(static_cast<SharedBacking*>(backingptr)->Int32At(index), value, __ATOMIC_SEQ_CST);
+}
+
+int32_t v8_SharedBacking_CompareExchange(SharedBackingPtr backingptr, size_t index,
+                                         int32_t expected, int32_t value) {
+  __atomic_compare_exchange_n(static_cast<SharedBacking*>(backingptr)->Int32At(index), &expected, value,
+                              false, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+  return expected;
+}
+
+PersistentValuePtr v8_SharedArrayBuffer_New(ContextPtr ctxptr, SharedBackingPtr backingptr) {
+  VALUE_SCOPE(ctxptr);
+
+  SharedBacking* backing = static_cast<SharedBacking*>(backingptr);
+  v8::Local<v8::SharedArrayBuffer> buf = v8::SharedArrayBuffer::New(isolate, backing->data, backing->len);
+
+  backing->Retain();
+  SharedBufferRef* ref = new SharedBufferRef;
+  ref->backing = backing;
+  ref->handle.Reset(isolate, buf);
+  ref->handle.SetWeak(ref, shared_buffer_collected, v8::WeakCallbackType::kParameter);
+  isolate_data(isolate)->shared_buffers.insert(ref);
+
+  return new Value(isolate, buf);
+}
+
+// Compiles Wasm *bytes*, or deserializes *cache* (the output of
+// v8_WasmModule_Serialize) if it was produced by this version of V8 from the
+// same bytes. A stale or empty cache falls back to compiling.
+ValueErrorPair v8_WasmModule_Compile(ContextPtr ctxptr, const uint8_t* bytes, size_t len,
+                                     const uint8_t* cache, size_t cache_len) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::TryCatch try_catch(isolate);
+  try_catch.SetVerbose(false);
+
+  v8::Local<v8::WasmCompiledModule> module;
+  if (!v8::WasmCompiledModule::DeserializeOrCompile(
+        isolate, std::make_pair(cache, cache_len), std::make_pair(bytes, len)).ToLocal(&module)) {
+    if (try_catch.HasCaught()) {
+      return caught_exception(isolate, try_catch);
+    }
+    return (ValueErrorPair){nullptr, str_to_cr_str("Invalid WebAssembly module")};
+  }
+
+  return (ValueErrorPair){new Value(isolate, module), nullptr};
+}
+
+String v8_WasmModule_Serialize(ContextPtr ctxptr, PersistentValuePtr moduleptr) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::Local<v8::Value> value = static_cast<Value*>(moduleptr)->Get(isolate);
+  if (!value->IsWebAssemblyCompiledModule()) {
+    return (String){nullptr, 0};
+  }
+
+  v8::WasmCompiledModule::SerializedModule serialized = value.As<v8::WasmCompiledModule>()->Serialize();
+  char* data = static_cast<char*>(malloc(serialized.second));
+  memcpy(data, serialized.first.get(), serialized.second);
+  return (String){data, int(serialized.second)};
+}
+
+// Instantiates *module* in this context through `WebAssembly.Instance`, so
+// modules compiled in one context can be instantiated in any other context
+// of the isolate.
+ValueErrorPair v8_WasmModule_Instantiate(ContextPtr ctxptr, PersistentValuePtr moduleptr,
+                                         PersistentValuePtr importsptr) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::TryCatch try_catch(isolate);
+  try_catch.SetVerbose(false);
+
+  v8::Local<v8::Value> wasm, instance_ctor;
+  if (!ctx->Global()->Get(ctx, v8::String::NewFromUtf8(isolate, "WebAssembly")).ToLocal(&wasm) ||
+      !wasm->IsObject() ||
+      !wasm.As<v8::Object>()->Get(ctx, v8::String::NewFromUtf8(isolate, "Instance")).ToLocal(&instance_ctor) ||
+      !instance_ctor->IsFunction()) {
+    return (ValueErrorPair){nullptr, str_to_cr_str("WebAssembly is not available")};
+  }
+
+  v8::Local<v8::Value> argv[2] = { static_cast<Value*>(moduleptr)->Get(isolate) };
+  int argc = 1;
+  if (importsptr != nullptr) {
+    argv[argc++] = static_cast<Value*>(importsptr)->Get(isolate);
+  }
+
+  v8::Local<v8::Object> instance;
+  if (!instance_ctor.As<v8::Function>()->NewInstance(ctx, argc, argv).ToLocal(&instance)) {
+    return caught_exception(isolate, try_catch);
+  }
+
+  return (ValueErrorPair){new Value(isolate, instance), nullptr};
+}
+
+// Returns the backing store of the instance's exported memory *name* without
+// copying it, or null if there is no such memory. Growing the memory detaches
+// the buffer, so the pointer is only good until then.
+unsigned char* v8_WasmInstance_Memory(ContextPtr ctxptr, PersistentValuePtr instanceptr,
+                                      const char* name, size_t* length) {
+  VALUE_SCOPE(ctxptr);
+
+  v8::Local<v8::Value> instance = static_cast<Value*>(instanceptr)->Get(isolate);
+  v8::Local<v8::Value> exports, memory, buffer;
+  if (!instance->IsObject() ||
+      !instance.As<v8::Object>()->Get(ctx, v8::String::NewFromUtf8(isolate, "exports")).ToLocal(&exports) ||
+      !exports->IsObject() ||
+      !exports.As<v8::Object>()->Get(ctx, v8::String::NewFromUtf8(isolate, name)).ToLocal(&memory) ||
+      !memory->IsObject() ||
+      !memory.As<v8::Object>()->Get(ctx, v8::String::NewFromUtf8(isolate, "buffer")).ToLocal(&buffer) ||
+      !buffer->IsArrayBuffer()) {
+    return nullptr;
+  }
+
+  v8::ArrayBuffer::Contents contents = buffer.As<v8::ArrayBuffer>()->GetContents();
+  *length = contents.ByteLength();
+  return static_cast<unsigned char*>(contents.Data());
+}
+
 ValueTuple v8_Value_PromiseResult(ContextPtr ctxptr, PersistentValuePtr valueptr) {
   VALUE_SCOPE(ctxptr);
 
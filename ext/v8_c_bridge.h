@@ -15,6 +15,10 @@ typedef void* IsolatePtr;
 typedef void* ContextPtr;
 typedef void* PersistentValuePtr;
 typedef void* FunctionTemplate;
+typedef void* ObjectTemplatePtr;
+typedef void* ScriptStreamPtr;
+typedef void* SharedBackingPtr;
+typedef void* ExceptionPtr;
 // typedef void* FunctionCallback;
 
 typedef struct {
@@ -37,11 +41,28 @@ typedef struct {
     size_t does_zap_garbage;
 } HeapStatistics;
 
+// A failed call sets either error_msg, for errors raised by the bridge
+// itself, or Exception, for anything thrown in JS.
 typedef struct {
     PersistentValuePtr Value;
     Error error_msg;
+    ExceptionPtr Exception;
 } ValueErrorPair;
 
+typedef struct {
+    String Str;
+    Error error_msg;
+    ExceptionPtr Exception;
+} StringErrorPair;
+
+// Returned by Crystal callbacks. Exception rethrows a caught JS exception,
+// error_msg throws a new Error, and otherwise Value is returned (if set).
+typedef struct {
+    PersistentValuePtr Value;
+    Error error_msg;
+    ExceptionPtr Exception;
+} CallbackResult;
+
 // NOTE! These values must exactly match the values in kinds.go. Any mismatch
 // will cause kinds to be misreported.
 typedef enum {
@@ -125,21 +146,51 @@ typedef struct {
     int Column;
 } CallerInfo;
 
+// Argument or result of a typed callback, see v8_Context_BindTyped.
+typedef union {
+    double Float64;
+    int32_t Int32;
+    uint32_t Uint32;
+    int Bool;
+} TypedValue;
+
+// Heap limits of a new isolate in MB, 0 meaning V8's default.
+typedef struct {
+    size_t max_semi_space_size;
+    size_t max_old_space_size;
+} ResourceLimits;
+
 typedef struct { int Major, Minor, Build, Patch; } Version;
 extern Version version;
 
 typedef unsigned int uint32_t;
 
-// v8_init must be called once before anything else.
-extern void v8_init();
+// v8_init must be called once before anything else, after any v8_SetFlags.
+extern void v8_SetFlags(const char* flags);
+extern void v8_init(int thread_pool_size);
 
 extern StartupData v8_CreateSnapshotDataBlob(const char* js);
+extern void v8_StartupData_Release(StartupData data);
 
-extern IsolatePtr v8_Isolate_New(StartupData data);
-extern ContextPtr v8_Isolate_NewContext(IsolatePtr isolate);
+extern IsolatePtr v8_Isolate_New(StartupData data, ResourceLimits limits);
+extern ContextPtr v8_Isolate_NewContext(IsolatePtr isolate, const char* id);
 extern void       v8_Isolate_Terminate(IsolatePtr isolate);
 extern void       v8_Isolate_Release(IsolatePtr isolate);
 
+extern ObjectTemplatePtr v8_Isolate_GlobalTemplate(IsolatePtr isolate);
+
+extern ObjectTemplatePtr v8_ObjectTemplate_New(IsolatePtr isolate);
+extern void v8_ObjectTemplate_SetFunction(IsolatePtr isolate, ObjectTemplatePtr tmpl,
+                                          const char* name, const char* id);
+extern void v8_ObjectTemplate_SetTemplate(IsolatePtr isolate, ObjectTemplatePtr tmpl,
+                                          const char* name, ObjectTemplatePtr value);
+extern void v8_ObjectTemplate_SetAccessor(IsolatePtr isolate, ObjectTemplatePtr tmpl,
+                                          const char* name, const char* id);
+extern void v8_ObjectTemplate_SetNamedHandler(IsolatePtr isolate, ObjectTemplatePtr tmpl, const char* id);
+extern void v8_ObjectTemplate_SetIndexedHandler(IsolatePtr isolate, ObjectTemplatePtr tmpl, const char* id);
+extern PersistentValuePtr v8_ObjectTemplate_NewInstance(ContextPtr ctx, ObjectTemplatePtr tmpl, void* holder);
+extern void v8_ObjectTemplate_Release(IsolatePtr isolate, ObjectTemplatePtr tmpl);
+
 extern HeapStatistics       v8_Isolate_GetHeapStatistics(IsolatePtr isolate);
 extern void       v8_Isolate_LowMemoryNotification(IsolatePtr isolate);
 
@@ -148,9 +199,21 @@ extern void       v8_Isolate_LowMemoryNotification(IsolatePtr isolate);
 extern PersistentValuePtr v8_Context_RegisterCallback(ContextPtr ctx,
                                                       const char* name, const char* id);
 extern PersistentValuePtr v8_Context_Global(ContextPtr ctx);
+extern ScriptStreamPtr v8_Context_StartStreaming(ContextPtr ctx);
+extern void            v8_ScriptStream_Push(ScriptStreamPtr stream, const char* data, int len);
+extern void            v8_ScriptStream_Finish(ScriptStreamPtr stream);
+extern int             v8_ScriptStream_CompiledFd(ScriptStreamPtr stream);
+extern ValueErrorPair  v8_ScriptStream_Run(ContextPtr ctx, ScriptStreamPtr stream, const char* filename);
+extern void            v8_ScriptStream_Release(ScriptStreamPtr stream);
+
+extern void               v8_Context_BindTyped(ContextPtr ctx, const char* name,
+                                               const char* signature, void* data);
+extern ValueErrorPair     v8_Context_RunModule(ContextPtr ctx,
+                                               const char* code, const char* specifier);
 extern void               v8_Context_Release(ContextPtr ctx);
+extern void               v8_Context_Reset(ContextPtr ctx);
 
-typedef enum { tSTRING, tBOOL, tNUMBER, tOBJECT, tARRAY, tARRAYBUFFER, tUNDEFINED } ImmediateValueType;
+typedef enum { tSTRING, tBOOL, tNUMBER, tOBJECT, tARRAY, tARRAYBUFFER, tUNDEFINED, tNULL, tVALUE } ImmediateValueType;
 typedef struct {
     ImmediateValueType Type;
     String Str;
@@ -158,18 +221,58 @@ typedef struct {
     double Num;
     unsigned char* Bytes;
     int Len;
+    PersistentValuePtr Value;  // For tVALUE.
 } ImmediateValue;
 
 extern Version v8_Version();
 
 extern PersistentValuePtr v8_Context_Create(ContextPtr ctx, ImmediateValue val);
 
+extern ValueErrorPair v8_Function_CallImmediate(ContextPtr ctx,
+                                                PersistentValuePtr func, ImmediateValue self,
+                                                int argc, ImmediateValue* argv);
+extern ValueErrorPair v8_Function_NewImmediate(ContextPtr ctx,
+                                               PersistentValuePtr func,
+                                               int argc, ImmediateValue* argv);
+
+extern ValueErrorPair  v8_Context_ParseJSON(ContextPtr ctx, const char* json, int len);
+extern StringErrorPair v8_Value_Stringify(ContextPtr ctx, PersistentValuePtr value, char* out, int capacity);
+
 // extern ValueTuple  v8_Value_Get(ContextPtr ctx, PersistentValuePtr value, const char* field);
 // extern Error           v8_Value_Set(ContextPtr ctx, PersistentValuePtr value,
                                     // const char* field, PersistentValuePtr new_value);
 extern ValueTuple  v8_Value_GetIdx(ContextPtr ctx, PersistentValuePtr value, int idx);
 extern Error           v8_Value_SetIdx(ContextPtr ctx, PersistentValuePtr value,
                                        int idx, PersistentValuePtr new_value);
+extern int   v8_Array_CopyFloat64(ContextPtr ctx, PersistentValuePtr array, double* out, int capacity);
+extern int   v8_Array_GetRange(ContextPtr ctx, PersistentValuePtr array,
+                               int start, int count, PersistentValuePtr* out);
+extern PersistentValuePtr v8_Array_NewFloat64(ContextPtr ctx, const double* values, int len);
+extern PersistentValuePtr v8_Array_NewImmediate(ContextPtr ctx, ImmediateValue* values, int len);
+extern SharedBackingPtr   v8_SharedBacking_New(size_t len);
+extern void*              v8_SharedBacking_Data(SharedBackingPtr backing);
+extern void               v8_SharedBacking_Release(SharedBackingPtr backing);
+extern int32_t            v8_SharedBacking_Load(SharedBackingPtr backing, size_t index);
+extern void               v8_SharedBacking_Store(SharedBackingPtr backing, size_t index, int32_t value);
+extern int32_t            v8_SharedBacking_Add(SharedBackingPtr backing, size_t index, int32_t value);
+extern int32_t            v8_SharedBacking_CompareExchange(SharedBackingPtr backing, size_t index,
+                                                           int32_t expected, int32_t value);
+extern PersistentValuePtr v8_SharedArrayBuffer_New(ContextPtr ctx, SharedBackingPtr backing);
+
+extern ValueErrorPair     v8_WasmModule_Compile(ContextPtr ctx, const uint8_t* bytes, size_t len,
+                                                const uint8_t* cache, size_t cache_len);
+extern String             v8_WasmModule_Serialize(ContextPtr ctx, PersistentValuePtr module);
+extern ValueErrorPair     v8_WasmModule_Instantiate(ContextPtr ctx, PersistentValuePtr module,
+                                                    PersistentValuePtr imports);
+extern unsigned char*     v8_WasmInstance_Memory(ContextPtr ctx, PersistentValuePtr instance,
+                                                 const char* name, size_t* length);
+
+extern PersistentValuePtr v8_Exception_Value(ContextPtr ctx, ExceptionPtr exc);
+extern String             v8_Exception_Report(ContextPtr ctx, ExceptionPtr exc);
+extern String             v8_Exception_Stack(ContextPtr ctx, ExceptionPtr exc);
+extern CallerInfo         v8_Exception_Location(ContextPtr ctx, ExceptionPtr exc);
+extern void               v8_Exception_Release(IsolatePtr isolate, ExceptionPtr exc);
+
 extern ValueTuple  v8_Value_PromiseResult(ContextPtr ctx, PersistentValuePtr value);
 extern uint8_t v8_Value_PromiseState(ContextPtr ctx, PersistentValuePtr value);
 // extern ValueTuple  v8_Value_Call(ContextPtr ctx,
@@ -179,7 +282,8 @@ extern uint8_t v8_Value_PromiseState(ContextPtr ctx, PersistentValuePtr value);
 extern ValueTuple  v8_Value_New(ContextPtr ctx,
                                     PersistentValuePtr func,
                                     int argc, PersistentValuePtr* argv);
-extern void   v8_Value_Release(ContextPtr ctx, PersistentValuePtr value);
+extern void   v8_Value_Release(IsolatePtr isolate, PersistentValuePtr value);
+extern uint64_t v8_Value_CreatedCount();
 // extern String v8_Value_String(ContextPtr ctx, PersistentValuePtr value);
 extern double v8_Value_Float64(ContextPtr ctx, PersistentValuePtr value);
 extern int64_t v8_Value_Int64(ContextPtr ctx, PersistentValuePtr value);